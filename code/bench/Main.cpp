@@ -0,0 +1,174 @@
+/// This file is a part of Capn.
+///
+/// Capn is a useful and multipurpose hooking library for the Windows platform.
+///
+/// Copyright 2015 Aaron Bolyard.
+///
+/// For licensing information, review the LICENSE file located at the root
+/// directory of the source package.
+#include <cstdio>
+#include <cstdlib>
+#include <windows.h>
+
+#include "Hook.hpp"
+
+// The benchmark hooks functions exported from its own executable, so it
+// doesn't depend on the behavior of any system DLL. The module name must match
+// the target name in premake4.lua.
+#define BENCH_MODULE "bench.exe"
+
+// Each benchmark gets its own export, since installing a second hook on the
+// same export would chain to the first.
+extern "C" __declspec(dllexport) int BenchPlain(int value)
+{
+	return value + 1;
+}
+
+extern "C" __declspec(dllexport) int BenchHooked(int value)
+{
+	return value + 1;
+}
+
+extern "C" __declspec(dllexport) int BenchFilteredMiss(int value)
+{
+	return value + 1;
+}
+
+extern "C" __declspec(dllexport) int BenchFilteredHit(int value)
+{
+	return value + 1;
+}
+
+extern "C" __declspec(dllexport) int BenchGuarded(int value)
+{
+	return value + 1;
+}
+
+extern "C" __declspec(dllexport) int BenchThreadLocal(int value)
+{
+	return value + 1;
+}
+
+extern "C" __declspec(dllexport) int BenchGuardedNested(int value)
+{
+	return value + 1;
+}
+
+extern "C" __declspec(dllexport) int BenchThreadLocalNested(int value)
+{
+	return value + 1;
+}
+
+typedef int (__cdecl * BenchProc)(int);
+
+// A hook that applies to every caller.
+HOOK_UTIL_CREATE(BenchHooked, BENCH_MODULE, int, __cdecl, int value)
+	return HOOK_UTIL_CALL_BASE(value);
+HOOK_UTIL_END()
+
+// A hook that applies only to callers from system modules; the benchmark's
+// calls never match. There are a few modules, so the lookup has to search
+// a non-trivial table on a cache miss.
+const char* systemModules[] = { "ntdll.dll", "kernel32.dll", "kernelbase.dll", "user32.dll", NULL };
+HOOK_UTIL_CREATE_FILTERED(BenchFilteredMiss, BENCH_MODULE, systemModules, int, __cdecl, int value)
+	return HOOK_UTIL_CALL_BASE(value);
+HOOK_UTIL_END()
+
+// A hook that applies only to callers from the benchmark itself.
+const char* benchModules[] = { BENCH_MODULE, NULL };
+HOOK_UTIL_CREATE_FILTERED(BenchFilteredHit, BENCH_MODULE, benchModules, int, __cdecl, int value)
+	return HOOK_UTIL_CALL_BASE(value);
+HOOK_UTIL_END()
+
+// A hook with the built-in reentrancy guard.
+HOOK_UTIL_CREATE_GUARDED(BenchGuarded, BENCH_MODULE, int, __cdecl, int value)
+	return HOOK_UTIL_CALL_BASE(value);
+HOOK_UTIL_END()
+
+// A hook with the usual hand-written guard, for comparison.
+__declspec(thread) bool benchThreadLocalRunning = false;
+HOOK_UTIL_CREATE(BenchThreadLocal, BENCH_MODULE, int, __cdecl, int value)
+	if (benchThreadLocalRunning)
+		return HOOK_UTIL_CALL_BASE(value);
+
+	benchThreadLocalRunning = true;
+	int result = HOOK_UTIL_CALL_BASE(value);
+	benchThreadLocalRunning = false;
+
+	return result;
+HOOK_UTIL_END()
+
+// The same hooks, but each calls itself once through the export table, as
+// a hook that calls something hooked would. The nested call is caught by the
+// guard and sent to the original function.
+BenchProc benchGuardedNested = NULL;
+HOOK_UTIL_CREATE_GUARDED(BenchGuardedNested, BENCH_MODULE, int, __cdecl, int value)
+	return HOOK_UTIL_CALL_BASE(benchGuardedNested(value));
+HOOK_UTIL_END()
+
+BenchProc benchThreadLocalNested = NULL;
+__declspec(thread) bool benchThreadLocalNestedRunning = false;
+HOOK_UTIL_CREATE(BenchThreadLocalNested, BENCH_MODULE, int, __cdecl, int value)
+	if (benchThreadLocalNestedRunning)
+		return HOOK_UTIL_CALL_BASE(value);
+
+	benchThreadLocalNestedRunning = true;
+	int result = HOOK_UTIL_CALL_BASE(benchThreadLocalNested(value));
+	benchThreadLocalNestedRunning = false;
+
+	return result;
+HOOK_UTIL_END()
+
+// Number of calls made by each benchmark.
+const int Iterations = 10000000;
+
+// Calls the export `name' (as resolved through the export table, and thus the
+// hook) `Iterations' times and prints the average time per call.
+void RunBenchmark(const char* name)
+{
+	// Volatile so the call can't be inlined or hoisted.
+	BenchProc volatile proc = (BenchProc)GetProcAddress(GetModuleHandle(NULL), name);
+
+	if (!proc)
+	{
+		std::fprintf(stderr, "Could not find %s!\n", name);
+
+		return;
+	}
+
+	LARGE_INTEGER frequency, start, stop;
+	QueryPerformanceFrequency(&frequency);
+
+	// Warm up.
+	int value = 0;
+	for (int i = 0; i < Iterations / 10; ++i)
+		value = proc(value);
+
+	QueryPerformanceCounter(&start);
+
+	for (int i = 0; i < Iterations; ++i)
+		value = proc(value);
+
+	QueryPerformanceCounter(&stop);
+
+	double nanoseconds = (double)(stop.QuadPart - start.QuadPart) * 1e9 / (double)frequency.QuadPart;
+	std::printf("%-24s %8.2f ns/call (%d)\n", name, nanoseconds / Iterations, value);
+}
+
+int main()
+{
+	RunBenchmark("BenchPlain");
+	RunBenchmark("BenchHooked");
+	RunBenchmark("BenchFilteredMiss");
+	RunBenchmark("BenchFilteredHit");
+
+	benchGuardedNested = (BenchProc)GetProcAddress(GetModuleHandle(NULL), "BenchGuardedNested");
+	benchThreadLocalNested = (BenchProc)GetProcAddress(GetModuleHandle(NULL), "BenchThreadLocalNested");
+
+	RunBenchmark("BenchGuarded");
+	RunBenchmark("BenchThreadLocal");
+	RunBenchmark("BenchGuardedNested");
+	RunBenchmark("BenchThreadLocalNested");
+
+	return 0;
+}
@@ -8,6 +8,7 @@
 /// directory of the source package.
 #include <algorithm>
 #include <cctype>
+#include <cstdlib>
 #include <cstring>
 #include <windows.h>
 
@@ -37,8 +38,605 @@ Symbol::Symbol()
 	// Nothing.
 }
 
+CallerFilter::CallerFilter()
+	: id(0), modules(NULL), table(NULL), hook(NULL), base(NULL), thunk(NULL), next(NULL)
+{
+	// Nothing.
+}
+
+// Checks if a module name from the loader (a counted, wide string) is equal
+// to the provided name. Like IsModule, this method is case insensitive.
+bool IsModule(const char* a, const wchar_t* b, std::size_t length)
+{
+	if (std::strlen(a) != length)
+		return false;
+
+	for (std::size_t i = 0; i < length; ++i)
+	{
+		// Module names are ASCII for all practical purposes.
+		if (b[i] > 0x7F || std::tolower(a[i]) != std::tolower((char)b[i]))
+			return false;
+	}
+
+	return true;
+}
+
+// Gets the range of addresses occupied by a loaded module.
+ModuleRange GetModuleRange(HMODULE handle)
+{
+	DWORD header = (DWORD)handle;
+	IMAGE_DOS_HEADER* dosHeader = (IMAGE_DOS_HEADER*)header;
+	IMAGE_NT_HEADERS* ntHeader = (IMAGE_NT_HEADERS*)(header + dosHeader->e_lfanew);
+
+	ModuleRange range;
+	range.begin = header;
+	range.end = header + ntHeader->OptionalHeader.SizeOfImage;
+
+	return range;
+}
+
+// Used to search module range tables by address.
+bool CompareRangeBegin(DWORD address, const ModuleRange& range)
+{
+	return address < range.begin;
+}
+
+// Allocates a table with room for `count' ranges.
+ModuleRangeTable* AllocateRangeTable(DWORD count)
+{
+	// The table already has room for one range.
+	std::size_t size = sizeof(ModuleRangeTable);
+	if (count > 1)
+		size += (count - 1) * sizeof(ModuleRange);
+
+	ModuleRangeTable* table = (ModuleRangeTable*)std::malloc(size);
+	if (table)
+		table->count = count;
+
+	return table;
+}
+
+// Replaces the filter's table.
+//
+// The old table is intentionally leaked: another thread may be searching it
+// right now, and modules are loaded so rarely that reclaiming it isn't worth
+// it. This also guarantees a table's address is never reused, which the
+// per-thread caller cache relies on.
+void PublishRangeTable(CallerFilter* filter, ModuleRangeTable* table)
+{
+	InterlockedExchangePointer((PVOID volatile*)&filter->table, table);
+}
+
+// Protects the filter list and table updates. Callers of the hooks never
+// take this lock; they only read the current table.
+SRWLOCK filterLock = SRWLOCK_INIT;
+CallerFilter* filters = NULL;
+
+// Adds a range to the filter's table. filterLock must be held.
+void InsertModuleRange(CallerFilter* filter, const ModuleRange& range)
+{
+	ModuleRangeTable* table = filter->table;
+	ModuleRange* first = table->ranges;
+	ModuleRange* last = table->ranges + table->count;
+	ModuleRange* position = std::upper_bound(first, last, range.begin, CompareRangeBegin);
+
+	// The module may already be known (e.g., a load notification raced
+	// with the initial scan).
+	if (position != first && (position - 1)->begin == range.begin)
+		return;
+
+	ModuleRangeTable* newTable = AllocateRangeTable(table->count + 1);
+	if (!newTable)
+		return;
+
+	ModuleRange* newPosition = std::copy(first, position, newTable->ranges);
+	*newPosition = range;
+	std::copy(position, last, newPosition + 1);
+
+	PublishRangeTable(filter, newTable);
+}
+
+// Removes the range beginning at `begin' from the filter's table, if it
+// exists. filterLock must be held.
+void RemoveModuleRange(CallerFilter* filter, DWORD begin)
+{
+	ModuleRangeTable* table = filter->table;
+	ModuleRange* first = table->ranges;
+	ModuleRange* last = table->ranges + table->count;
+	ModuleRange* position = std::upper_bound(first, last, begin, CompareRangeBegin);
+
+	if (position == first || (position - 1)->begin != begin)
+		return;
+
+	ModuleRangeTable* newTable = AllocateRangeTable(table->count - 1);
+	if (!newTable)
+		return;
+
+	std::copy(position, last, std::copy(first, position - 1, newTable->ranges));
+
+	PublishRangeTable(filter, newTable);
+}
+
+// The last caller lookup made by this thread for a filter.
+//
+// [begin, end) is either a selected module or the gap between two selected
+// modules. Either way, every address in it has the same answer, so repeated
+// calls from the same module skip the search entirely.
+struct CallerCache
+{
+	const ModuleRangeTable* table;
+	DWORD begin;
+	DWORD end;
+	bool selected;
+};
+
+// Number of cache entries per thread. Each filter uses the entry at its ID
+// modulo this; past this many filters, entries are shared, which only costs
+// extra searches since entries are checked against the filter's table.
+#define CALLER_CACHE_SIZE 64
+
+__declspec(thread) CallerCache callerCaches[CALLER_CACHE_SIZE];
+
+// Number of filters created so far.
+volatile LONG filterCount = 0;
+
+// Called by the thunk on every call to a filtered hook.
+// Returns where the call should go.
+void* __cdecl SelectCallerTarget(CallerFilter* filter, DWORD caller)
+{
+	const ModuleRangeTable* table = filter->table;
+	CallerCache& cache = callerCaches[filter->id % CALLER_CACHE_SIZE];
+
+	// Tables are specific to a filter, so the table also identifies the filter.
+	if (cache.table != table || caller - cache.begin >= cache.end - cache.begin)
+	{
+		const ModuleRange* first = table->ranges;
+		const ModuleRange* last = table->ranges + table->count;
+		const ModuleRange* next = std::upper_bound(first, last, caller, CompareRangeBegin);
+
+		cache.table = table;
+
+		if (next != first && caller < (next - 1)->end)
+		{
+			cache.begin = (next - 1)->begin;
+			cache.end = (next - 1)->end;
+			cache.selected = true;
+		}
+		else
+		{
+			cache.begin = (next != first) ? (next - 1)->end : 0;
+			cache.end = (next != last) ? next->begin : 0xFFFFFFFF;
+			cache.selected = false;
+		}
+	}
+
+	if (cache.selected)
+		return filter->hook;
+
+	return *filter->base;
+}
+
+// Thunks are packed into pages taken from a shared region, rather than each
+// getting its own allocation; VirtualAlloc reserves 64 KB at a time, which adds
+// up quickly in a 32-bit process. Thunks are never freed.
+#define THUNK_REGION_SIZE 0x10000
+#define THUNK_PAGE_SIZE 0x1000
+#define THUNK_ALIGNMENT 16
+
+// Protects the region and the bump pointer.
+SRWLOCK thunkLock = SRWLOCK_INIT;
+char* thunkRegionEnd = NULL;
+char* thunkNext = NULL;
+char* thunkPageEnd = NULL;
+
+// Makes room for `size' bytes of code within a single page. Returns the start
+// of the room, or NULL if there's no memory left. thunkLock must be held.
+char* AllocateThunk(std::size_t size)
+{
+	// Thunks never straddle pages, so each only needs its own page unprotected.
+	if (thunkNext == NULL || thunkNext + size > thunkPageEnd)
+	{
+		if (thunkPageEnd == thunkRegionEnd)
+		{
+			char* region = (char*)VirtualAlloc(NULL, THUNK_REGION_SIZE, MEM_RESERVE, PAGE_NOACCESS);
+			if (!region)
+				return NULL;
+
+			thunkRegionEnd = region + THUNK_REGION_SIZE;
+			thunkPageEnd = region;
+		}
+
+		// Pages are committed executable; they're only made writable briefly,
+		// while a thunk is copied in.
+		if (!VirtualAlloc(thunkPageEnd, THUNK_PAGE_SIZE, MEM_COMMIT, PAGE_EXECUTE_READ))
+			return NULL;
+
+		thunkNext = thunkPageEnd;
+		thunkPageEnd += THUNK_PAGE_SIZE;
+	}
+
+	char* thunk = thunkNext;
+	thunkNext += (size + THUNK_ALIGNMENT - 1) & ~(THUNK_ALIGNMENT - 1);
+
+	return thunk;
+}
+
+// Copies generated code into executable memory.
+void* CreateThunk(const unsigned char* code, std::size_t size)
+{
+	AcquireSRWLockExclusive(&thunkLock);
+
+	char* thunk = AllocateThunk(size);
+	char* page = (char*)((DWORD)thunk & ~(THUNK_PAGE_SIZE - 1));
+	DWORD protection = 0;
+
+	// Other thunks on the page may be running, so it stays executable while
+	// it's written to.
+	if (thunk && VirtualProtect(page, THUNK_PAGE_SIZE, PAGE_EXECUTE_READWRITE, &protection))
+	{
+		std::memcpy(thunk, code, size);
+
+		VirtualProtect(page, THUNK_PAGE_SIZE, protection, &protection);
+		FlushInstructionCache(GetCurrentProcess(), page, THUNK_PAGE_SIZE);
+	}
+	else
+	{
+		thunk = NULL;
+	}
+
+	ReleaseSRWLockExclusive(&thunkLock);
+
+	return thunk;
+}
+
+// Generates the code that dispatches a filtered hook:
+//
+//   push ecx
+//   push edx
+//   push [esp + 8]             ; return address
+//   push filter
+//   mov eax, SelectCallerTarget
+//   call eax
+//   add esp, 8
+//   pop edx
+//   pop ecx
+//   jmp eax
+//
+// ECX and EDX are preserved in case the hooked function takes arguments in
+// registers. Since the thunk jumps (rather than calls) the target, the stack
+// is untouched and the target returns directly to the caller.
+void* CreateCallerThunk(CallerFilter* filter)
+{
+	unsigned char code[] =
+	{
+		0x51,
+		0x52,
+		0xFF, 0x74, 0x24, 0x08,
+		0x68, 0x00, 0x00, 0x00, 0x00,
+		0xB8, 0x00, 0x00, 0x00, 0x00,
+		0xFF, 0xD0,
+		0x83, 0xC4, 0x08,
+		0x5A,
+		0x59,
+		0xFF, 0xE0
+	};
+
+	DWORD filterAddress = (DWORD)filter;
+	DWORD selectAddress = (DWORD)SelectCallerTarget;
+	std::memcpy(code + 7, &filterAddress, sizeof(DWORD));
+	std::memcpy(code + 12, &selectAddress, sizeof(DWORD));
+
+	return CreateThunk(code, sizeof(code));
+}
+
+// Loader notification structures. These are not in the standard headers.
+struct LoaderString
+{
+	USHORT length;
+	USHORT maximumLength;
+	PWSTR buffer;
+};
+
+struct LoaderNotificationData
+{
+	ULONG flags;
+	const LoaderString* fullName;
+	const LoaderString* baseName;
+	PVOID base;
+	ULONG size;
+};
+
+enum LOADER_NOTIFICATION_REASON
+{
+	LOADER_NOTIFICATION_REASON_LOADED = 1,
+	LOADER_NOTIFICATION_REASON_UNLOADED = 2
+};
+
+typedef VOID (CALLBACK * LoaderNotificationProc)(ULONG reason, const LoaderNotificationData* data, PVOID context);
+typedef LONG (NTAPI * LdrRegisterDllNotificationProc)(ULONG flags, LoaderNotificationProc callback, PVOID context, PVOID* cookie);
+
+// Keeps the filter tables up-to-date as modules are loaded and unloaded.
+VOID CALLBACK OnLoaderNotification(ULONG reason, const LoaderNotificationData* data, PVOID)
+{
+	ModuleRange range;
+	range.begin = (DWORD)data->base;
+	range.end = range.begin + data->size;
+
+	AcquireSRWLockExclusive(&filterLock);
+
+	for (CallerFilter* filter = filters; filter != NULL; filter = filter->next)
+	{
+		if (reason == LOADER_NOTIFICATION_REASON_UNLOADED)
+		{
+			RemoveModuleRange(filter, range.begin);
+
+			continue;
+		}
+
+		for (const char* const* module = filter->modules; *module != NULL; ++module)
+		{
+			// The length is in bytes, not characters.
+			if (IsModule(*module, data->baseName->buffer, data->baseName->length / sizeof(wchar_t)))
+			{
+				InsertModuleRange(filter, range);
+
+				break;
+			}
+		}
+	}
+
+	ReleaseSRWLockExclusive(&filterLock);
+}
+
+typedef LONG (NTAPI * LdrUnregisterDllNotificationProc)(PVOID cookie);
+
+// The loader notification registration.
+//
+// This is separate from filterLock: the loader holds its own lock while
+// registering and while notifying, and the notification takes filterLock.
+SRWLOCK notificationLock = SRWLOCK_INIT;
+bool notificationRegistered = false;
+PVOID notificationCookie = NULL;
+
+// Registers for loader notifications, once. Returns when the registration is
+// complete, even if another thread started it.
+//
+// The notification API is undocumented, so it's looked up rather than linked
+// against. If it's missing, filters only know about modules loaded before the
+// hook was created.
+void RegisterLoaderNotification()
+{
+	AcquireSRWLockExclusive(&notificationLock);
+
+	if (!notificationRegistered)
+	{
+		notificationRegistered = true;
+
+		LdrRegisterDllNotificationProc registerNotification =
+			(LdrRegisterDllNotificationProc)GetProcAddress(GetModuleHandle("ntdll.dll"), "LdrRegisterDllNotification");
+
+		if (registerNotification)
+			registerNotification(0, OnLoaderNotification, NULL, &notificationCookie);
+	}
+
+	ReleaseSRWLockExclusive(&notificationLock);
+}
+
+// Unregisters the loader notification when the module containing the hooks
+// is unloaded; otherwise the loader would call into unmapped code.
+struct LoaderNotificationCleanup
+{
+	~LoaderNotificationCleanup()
+	{
+		AcquireSRWLockExclusive(&notificationLock);
+
+		if (notificationCookie)
+		{
+			LdrUnregisterDllNotificationProc unregisterNotification =
+				(LdrUnregisterDllNotificationProc)GetProcAddress(GetModuleHandle("ntdll.dll"), "LdrUnregisterDllNotification");
+
+			if (unregisterNotification)
+				unregisterNotification(notificationCookie);
+
+			notificationCookie = NULL;
+		}
+
+		ReleaseSRWLockExclusive(&notificationLock);
+	}
+} loaderNotificationCleanup;
+
+// Sets up a filter and adds it to the filter list.
+bool InitializeCallerFilter(CallerFilter* filter, const char* const* modules, void* hook)
+{
+	filter->id = InterlockedIncrement(&filterCount) - 1;
+	filter->modules = modules;
+	filter->hook = hook;
+	filter->table = AllocateRangeTable(0);
+	filter->thunk = CreateCallerThunk(filter);
+
+	if (!filter->table || !filter->thunk)
+		return false;
+
+	RegisterLoaderNotification();
+
+	// Add the filter to the list first, so modules loaded from here on are
+	// picked up by the notification.
+	AcquireSRWLockExclusive(&filterLock);
+	filter->next = filters;
+	filters = filter;
+	ReleaseSRWLockExclusive(&filterLock);
+
+	// Then add the modules that are already loaded. The loader holds its own
+	// lock while notifying, so don't call into it with filterLock held.
+	//
+	// Each module is pinned until its range is added. Otherwise, it could be
+	// unloaded in between, and the range would never be removed.
+	for (const char* const* module = modules; *module != NULL; ++module)
+	{
+		HMODULE handle = NULL;
+
+		if (GetModuleHandleEx(0, *module, &handle))
+		{
+			ModuleRange range = GetModuleRange(handle);
+
+			AcquireSRWLockExclusive(&filterLock);
+			InsertModuleRange(filter, range);
+			ReleaseSRWLockExclusive(&filterLock);
+
+			// If this was the last reference, the unload notification removes
+			// the range again.
+			FreeLibrary(handle);
+		}
+	}
+
+	return true;
+}
+
+// Where the first TLS slots (TEB::TlsSlots) are, relative to FS. Slots past
+// these are stored in a separately allocated array, which would take another
+// load (and a check that it exists) to find.
+#define GUARD_TLS_SLOTS_OFFSET 0xE10
+#define GUARD_TLS_SLOTS 64
+
+// Number of guards whose bits are in each TLS slot.
+#define GUARD_BITS_PER_SLOT 32
+
+// Protects the guard count and slots.
+SRWLOCK guardLock = SRWLOCK_INIT;
+
+// Number of guards given a bit so far.
+LONG guardCount = 0;
+
+// The TLS slots holding the guards' bits. Only the first
+// ceil(guardCount / GUARD_BITS_PER_SLOT) are allocated.
+DWORD guardSlots[HOOK_GUARD_MAX / GUARD_BITS_PER_SLOT];
+
+// Allocates a TLS slot that's stored in the TEB. Returns TLS_OUT_OF_INDEXES if
+// there isn't one.
+DWORD AllocateGuardSlot()
+{
+	DWORD slot = TlsAlloc();
+
+	if (slot != TLS_OUT_OF_INDEXES && slot >= GUARD_TLS_SLOTS)
+	{
+		TlsFree(slot);
+
+		return TLS_OUT_OF_INDEXES;
+	}
+
+	return slot;
+}
+
+// Frees the TLS slots when the module containing the hooks is unloaded.
+struct GuardSlotCleanup
+{
+	~GuardSlotCleanup()
+	{
+		AcquireSRWLockExclusive(&guardLock);
+
+		for (LONG i = 0; i * GUARD_BITS_PER_SLOT < guardCount; ++i)
+			TlsFree(guardSlots[i]);
+
+		guardCount = 0;
+
+		ReleaseSRWLockExclusive(&guardLock);
+	}
+} guardSlotCleanup;
+
+// Generates the code that dispatches a guarded hook:
+//
+//   test byte fs:[offset], mask    ; the hook's bit
+//   jnz running
+//   jmp [hook]
+// running:
+//   jmp [base]
+//
+// Only the flags are changed, and they don't hold arguments. The hook and base
+// are read through pointers, so the code doesn't depend on where it's placed.
+void* CreateGuardThunk(HookGuard* guard)
+{
+	unsigned char code[] =
+	{
+		0x64, 0xF6, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x75, 0x06,
+		0xFF, 0x25, 0x00, 0x00, 0x00, 0x00,
+		0xFF, 0x25, 0x00, 0x00, 0x00, 0x00
+	};
+
+	DWORD offset = guard->offset;
+	DWORD hookAddress = (DWORD)&guard->hook;
+	DWORD baseAddress = (DWORD)guard->base;
+
+	std::memcpy(code + 3, &offset, sizeof(DWORD));
+	code[7] = guard->mask;
+	std::memcpy(code + 12, &hookAddress, sizeof(DWORD));
+	std::memcpy(code + 18, &baseAddress, sizeof(DWORD));
+
+	return CreateThunk(code, sizeof(code));
+}
+
+HookGuard::HookGuard(void* newFunc, void** baseFunc)
+	: offset(0), mask(0), hook(newFunc), base(baseFunc), thunk(NULL)
+{
+	AcquireSRWLockExclusive(&guardLock);
+
+	LONG id = guardCount;
+	LONG group = id / GUARD_BITS_PER_SLOT;
+	LONG bit = id % GUARD_BITS_PER_SLOT;
+
+	if (id < HOOK_GUARD_MAX)
+	{
+		// The first guard in a group allocates the group's slot. If that fails,
+		// the count isn't advanced, so the next guard tries again.
+		if (bit == 0)
+			guardSlots[group] = AllocateGuardSlot();
+
+		if (guardSlots[group] != TLS_OUT_OF_INDEXES)
+		{
+			offset = GUARD_TLS_SLOTS_OFFSET + guardSlots[group] * sizeof(void*) + bit / 8;
+			mask = (unsigned char)(1 << (bit % 8));
+
+			++guardCount;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&guardLock);
+
+	// Out of bits or slots. The hook will simply not be guarded.
+	if (!mask)
+		return;
+
+	thunk = CreateGuardThunk(this);
+
+	// Without the thunk, the hook is called directly and never checks the bit,
+	// so don't bother setting it either.
+	if (!thunk)
+		mask = 0;
+}
+
 // Creates a hook.
 Hook::Hook(const char* dll, const char* func, void* newFunc, bool alwaysLoad, HOOK_TYPE_FLAGS flags)
+{
+	Install(dll, func, newFunc, alwaysLoad, flags);
+}
+
+// Creates a hook that only applies to certain callers.
+Hook::Hook(const char* dll, const char* func, void* newFunc, bool alwaysLoad, HOOK_TYPE_FLAGS flags, const char* const* callers)
+{
+	// Without a filter, the hook would apply to everyone, which is not what
+	// was asked for. Leave the function alone instead.
+	if (!InitializeCallerFilter(&callerFilter, callers, newFunc))
+		return;
+
+	// Unselected callers go to the same place HOOK_UTIL_CALL_BASE does. This
+	// must be set before the hook is installed, since calls may arrive as soon
+	// as it is.
+	callerFilter.base = &exportSymbol.function;
+
+	Install(dll, func, callerFilter.thunk, alwaysLoad, flags);
+}
+
+void Hook::Install(const char* dll, const char* func, void* newFunc, bool alwaysLoad, HOOK_TYPE_FLAGS flags)
 {
 	// Try and hook the export address table.
 	if (flags & HOOK_TYPE_FLAG_EXPORT)
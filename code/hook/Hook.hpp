@@ -9,6 +9,10 @@
 #ifndef CAPN_HOOK_HPP_
 #define CAPN_HOOK_HPP_
 
+#include <intrin.h>
+
+#include "Record.hpp"
+
 enum HOOK_TYPE_FLAGS
 {
 	// The hook should install itself into the export table.
@@ -33,14 +37,137 @@ struct Symbol
 	Symbol();
 };
 
+// A range of addresses, [begin, end), occupied by a loaded module.
+struct ModuleRange
+{
+	unsigned long begin;
+	unsigned long end;
+};
+
+// A sorted list of module ranges.
+// Tables are never modified once published; adding or removing a module
+// creates a new table.
+struct ModuleRangeTable
+{
+	unsigned long count;
+	ModuleRange ranges[1];
+};
+
+// Restricts a hook to callers from a set of modules.
+// Calls from any other module jump directly to the original function.
+struct CallerFilter
+{
+	// Identifies the filter's entry in the per-thread lookup cache.
+	unsigned int id;
+
+	// NULL-terminated list of module names, e.g. { "PLUGIN.DLL", NULL }.
+	const char* const* modules;
+
+	// Ranges of the selected modules that are currently loaded.
+	// Kept up-to-date as modules are loaded and unloaded.
+	ModuleRangeTable* volatile table;
+
+	// Where selected callers are sent.
+	void* hook;
+
+	// Where everyone else is sent. Read at call time, since the original
+	// function is not known until the hook is installed.
+	void** base;
+
+	// Generated code that checks the return address and jumps to either
+	// `hook' or `base'.
+	void* thunk;
+
+	// The next filter. All filters are kept in a list so module notifications
+	// can update them.
+	CallerFilter* next;
+
+	// Constructor.
+	CallerFilter();
+};
+
+// Maximum number of guarded hooks. Hooks beyond this are not guarded.
+#define HOOK_GUARD_MAX 1024
+
+// Keeps a hook from being re-entered on the same thread.
+//
+// Each guarded hook has a bit in the value of a TLS slot; 32 hooks share each
+// slot. The first 64 TLS slots are stored in the thread's TEB, at a fixed
+// offset from FS, so the bit can be tested with a single instruction:
+//   test byte ptr fs:[offset], mask
+//
+// Calls go through generated code that tests the bit and jumps to the original
+// function if it's set, or the hook otherwise. The hook sets the bit while
+// running (see HookGuardScope), so any calls it makes that end up back in the
+// hook (e.g., a hook on `write' that logs) go directly to the original function.
+struct HookGuard
+{
+	// The hook's bit: the byte at `offset' from FS, and the bit within it.
+	// `mask' is zero if the hook is not guarded.
+	unsigned long offset;
+	unsigned char mask;
+
+	// Where calls go when the hook is not running and running, respectively.
+	// `base' is read at call time, like CallerFilter::base.
+	void* hook;
+	void** base;
+
+	// Generated code that checks the bit.
+	void* thunk;
+
+	// Constructor. Guards `newFunc', whose original function is read from `baseFunc'.
+	HookGuard(void* newFunc, void** baseFunc);
+
+	// Gets what should be called instead of the hook.
+	// If the guard could not be created, this is the hook itself.
+	void* GetProc() const
+	{
+		return thunk ? thunk : hook;
+	}
+};
+
+// Marks a guarded hook as running on this thread for the lifetime of the scope.
+struct HookGuardScope
+{
+	const HookGuard& guard;
+
+	HookGuardScope(const HookGuard& hookGuard)
+		: guard(hookGuard)
+	{
+		if (guard.mask)
+			__writefsbyte(guard.offset, (unsigned char)(__readfsbyte(guard.offset) | guard.mask));
+	}
+
+	~HookGuardScope()
+	{
+		if (guard.mask)
+			__writefsbyte(guard.offset, (unsigned char)(__readfsbyte(guard.offset) & ~guard.mask));
+	}
+
+private:
+	HookGuardScope& operator =(const HookGuardScope&);
+};
+
 struct Hook
 {
 	Symbol exportSymbol;
 	Symbol importSymbol;
+	CallerFilter callerFilter;
 
 	// Constructor. Replaces the provided function with the new function.
 	Hook(const char* dll, const char* func, void* newFunc, bool alwaysLoad = false, HOOK_TYPE_FLAGS flags = HOOK_TYPE_FLAG_ALL);
 
+	// Constructor. Like above, but the new function is only called when the
+	// caller is in one of the modules in `callers' (a NULL-terminated list).
+	// Everyone else calls the original function directly.
+	//
+	// `callers' comes last, with nothing defaulted, so calls to the constructor
+	// above (e.g., Hook(dll, func, newFunc, 0)) are never ambiguous.
+	Hook(const char* dll, const char* func, void* newFunc, bool alwaysLoad, HOOK_TYPE_FLAGS flags, const char* const* callers);
+
+	// Finds the function and installs the hook. Used by the constructors.
+	void Install(const char* dll, const char* func, void* newFunc, bool alwaysLoad, HOOK_TYPE_FLAGS flags);
+
 	// Sets the hook to the provided value.
 	// Useful for returning to the original functionality, or changing the hook later.
 	bool SetExportHook(void* newFunc);
@@ -55,6 +182,23 @@ struct Hook
 	typedef returnType (callingConvention * funcName##Proc)(__VA_ARGS__); \
 	Hook funcName##Hook(funcModule, #funcName, (void*)funcName##Func, false);
 
+// Declares a hook that only applies to calls from the modules in `callers'.
+// `callers' must be a NULL-terminated array of module names, such as:
+//   const char* pluginModules[] = { "PLUGIN.DLL", NULL };
+#define HOOK_DECLARE_FILTERED(funcName, funcModule, callers, returnType, callingConvention, ...) \
+	returnType callingConvention funcName##Func (__VA_ARGS__); \
+	typedef returnType (callingConvention * funcName##Proc)(__VA_ARGS__); \
+	Hook funcName##Hook(funcModule, #funcName, (void*)funcName##Func, false, HOOK_TYPE_FLAG_ALL, callers);
+
+// Declares a guarded hook. While the hook is running, calls to it from the same
+// thread go directly to the original function; see HookGuard.
+#define HOOK_DECLARE_GUARDED(funcName, funcModule, returnType, callingConvention, ...) \
+	returnType callingConvention funcName##Func (__VA_ARGS__); \
+	typedef returnType (callingConvention * funcName##Proc)(__VA_ARGS__); \
+	extern Hook funcName##Hook; \
+	HookGuard funcName##Guard((void*)funcName##Func, &funcName##Hook.exportSymbol.function); \
+	Hook funcName##Hook(funcModule, #funcName, funcName##Guard.GetProc(), false);
+
 // Defines a previously declared hook.
 #define HOOK_DEFINE(funcName, returnType, callingConvention, ...) \
 	returnType callingConvention funcName##Func(__VA_ARGS__) \
@@ -63,10 +207,34 @@ struct Hook
 #define HOOK_CALL_PROC(funcName, ...) ((funcName##Proc)funcName##Hook.exportSymbol.function)(__VA_ARGS__)
 
 // Utility method to declare and define a hook in one place
+// Calls are recorded when recording is enabled; see Record.hpp.
 #define HOOK_UTIL_CREATE(funcName, funcModule, returnType, callingConvention, ...) \
+	HOOK_RECORD_DECLARE(funcName, funcModule, returnType, callingConvention, __VA_ARGS__) \
 	HOOK_DECLARE(funcName, funcModule, returnType, callingConvention, __VA_ARGS__) \
 	HOOK_DEFINE(funcName, returnType, callingConvention, __VA_ARGS__) \
 	{ \
+		HOOK_RECORD_CALL(funcName) \
+		funcName##Proc _hook_internal_base_proc = (funcName##Proc)funcName##Hook.exportSymbol.function;
+
+// Utility method to declare and define a filtered hook in one place.
+// The body is only run for callers in `callers'; see HOOK_DECLARE_FILTERED.
+#define HOOK_UTIL_CREATE_FILTERED(funcName, funcModule, callers, returnType, callingConvention, ...) \
+	HOOK_RECORD_DECLARE(funcName, funcModule, returnType, callingConvention, __VA_ARGS__) \
+	HOOK_DECLARE_FILTERED(funcName, funcModule, callers, returnType, callingConvention, __VA_ARGS__) \
+	HOOK_DEFINE(funcName, returnType, callingConvention, __VA_ARGS__) \
+	{ \
+		HOOK_RECORD_CALL(funcName) \
+		funcName##Proc _hook_internal_base_proc = (funcName##Proc)funcName##Hook.exportSymbol.function;
+
+// Utility method to declare and define a guarded hook in one place.
+// The body is never re-entered on the same thread; see HOOK_DECLARE_GUARDED.
+#define HOOK_UTIL_CREATE_GUARDED(funcName, funcModule, returnType, callingConvention, ...) \
+	HOOK_RECORD_DECLARE(funcName, funcModule, returnType, callingConvention, __VA_ARGS__) \
+	HOOK_DECLARE_GUARDED(funcName, funcModule, returnType, callingConvention, __VA_ARGS__) \
+	HOOK_DEFINE(funcName, returnType, callingConvention, __VA_ARGS__) \
+	{ \
+		HookGuardScope _hook_internal_guard(funcName##Guard); \
+		HOOK_RECORD_CALL(funcName) \
 		funcName##Proc _hook_internal_base_proc = (funcName##Proc)funcName##Hook.exportSymbol.function;
 
 // Utility for so-called 'far' hooks.
@@ -91,20 +259,40 @@ struct Hook
 
 // Creates a far hook. Similar in usage to HOOK_UTIL_CREATE.
 #define HOOK_UTIL_CREATE_FAR(funcName, returnType, callingConvention, ...) \
+	HOOK_RECORD_DECLARE(funcName, "", returnType, callingConvention, __VA_ARGS__) \
 	HOOK_UTIL_DECLARE_FAR(funcName, returnType, callingConvention, __VA_ARGS__); \
 	returnType callingConvention funcName##Hook(__VA_ARGS__) \
 	{ \
+		HOOK_RECORD_CALL(funcName) \
+		funcName##Proc _hook_internal_base_proc = funcName##FarHook;
+
+// Creates a guarded far hook. Similar in usage to HOOK_UTIL_CREATE_GUARDED.
+#define HOOK_UTIL_CREATE_FAR_GUARDED(funcName, returnType, callingConvention, ...) \
+	HOOK_RECORD_DECLARE(funcName, "", returnType, callingConvention, __VA_ARGS__) \
+	HOOK_UTIL_DECLARE_FAR(funcName, returnType, callingConvention, __VA_ARGS__); \
+	returnType callingConvention funcName##Hook(__VA_ARGS__); \
+	HookGuard funcName##Guard((void*)funcName##Hook, (void**)&funcName##FarHook); \
+	returnType callingConvention funcName##Hook(__VA_ARGS__) \
+	{ \
+		HookGuardScope _hook_internal_guard(funcName##Guard); \
+		HOOK_RECORD_CALL(funcName) \
 		funcName##Proc _hook_internal_base_proc = funcName##FarHook;
 
 // Gets the far hook.
 #define HOOK_UTIL_GET_FAR_PROC(funcName) \
 	funcName##Hook
 
+// Gets a far hook created with HOOK_UTIL_CREATE_FAR_GUARDED. This is what must
+// be returned in place of the original, so that calls go through the guard.
+#define HOOK_UTIL_GET_FAR_GUARDED_PROC(funcName) \
+	((funcName##Proc)funcName##Guard.GetProc())
+
 // Calls a previously defined far hook.
 #define HOOK_UTIL_CALL_FAR(funcName, ...) \
 	funcName##FarHook(__VA_ARGS__);
 
 // Utility method to call the original method of a hook created with HOOK_UTIL_CREATE or HOOK_UTIL_CREATE_FAR
+// (or any of their variants).
 #define HOOK_UTIL_CALL_BASE(...) \
 	_hook_internal_base_proc(__VA_ARGS__)
 
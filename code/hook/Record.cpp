@@ -0,0 +1,243 @@
+/// This file is a part of Capn.
+///
+/// Capn is a useful and multipurpose hooking library for the Windows platform.
+///
+/// Copyright 2015 Aaron Bolyard.
+///
+/// For licensing information, review the LICENSE file located at the root
+/// directory of the source package.
+#include <cstring>
+#include <windows.h>
+
+#include "Record.hpp"
+
+volatile long hookRecording = 0;
+
+// Protects the function list and the log.
+//
+// Hooks hold this shared while writing a record, so the log can't be closed
+// out from under them; starting and stopping hold it exclusively.
+SRWLOCK recordLock = SRWLOCK_INIT;
+HookRecordFunction* recordFunctions = NULL;
+volatile LONG recordFunctionCount = 0;
+
+// The log, while recording.
+HANDLE recordFile = INVALID_HANDLE_VALUE;
+HANDLE recordMapping = NULL;
+char* recordView = NULL;
+LONG recordCapacity = 0;
+volatile LONG recordOffset = 0;
+volatile LONG recordDropped = 0;
+
+// Reserves `size' bytes in the log. Returns NULL if the log is full.
+// recordLock must be held.
+HookLogRecord* ReserveRecord(LONG size)
+{
+	LONG offset;
+
+	do
+	{
+		offset = recordOffset;
+
+		if (size > recordCapacity - offset)
+			return NULL;
+	} while (InterlockedCompareExchange(&recordOffset, offset + size, offset) != offset);
+
+	return (HookLogRecord*)(recordView + offset);
+}
+
+// Gets the current time, in ticks.
+unsigned long long GetRecordTime()
+{
+	LARGE_INTEGER time;
+	QueryPerformanceCounter(&time);
+
+	return time.QuadPart;
+}
+
+// Writes a function record. recordLock must be held.
+void WriteFunctionRecord(const HookRecordFunction& function)
+{
+	std::size_t moduleLength = std::strlen(function.module) + 1;
+	std::size_t nameLength = std::strlen(function.name) + 1;
+	LONG size = HookLogRecordSize(sizeof(HookLogFunction) + moduleLength + nameLength);
+
+	HookLogRecord* record = ReserveRecord(size);
+	if (!record)
+		return;
+
+	record->size = size;
+	record->type = HOOK_LOG_RECORD_TYPE_FUNCTION;
+	record->function = function.id;
+	record->time = GetRecordTime();
+
+	char* payload = (char*)(record + 1);
+	std::memcpy(payload, &function.description, sizeof(HookLogFunction));
+	std::memcpy(payload + sizeof(HookLogFunction), function.module, moduleLength);
+	std::memcpy(payload + sizeof(HookLogFunction) + moduleLength, function.name, nameLength);
+}
+
+HookRecordFunction::HookRecordFunction(const char* dll, const char* func, int count, void (* describe)(HookLogFunction&))
+	: module(dll ? dll : ""), name(func), id(0), recordable(count >= 0), next(NULL)
+{
+	std::memset(&description, 0, sizeof(HookLogFunction));
+
+	if (recordable)
+	{
+		description.argumentCount = count;
+		describe(description);
+
+		for (int i = 0; i < count; ++i)
+		{
+			if (description.kinds[i] == HOOK_ARGUMENT_KIND_UNKNOWN)
+				recordable = false;
+		}
+	}
+
+	// Unrecordable functions are never written to the log, so they don't
+	// need to be tracked.
+	if (!recordable)
+		return;
+
+	AcquireSRWLockExclusive(&recordLock);
+
+	id = (unsigned short)recordFunctionCount++;
+	next = recordFunctions;
+	recordFunctions = this;
+
+	// Recording may have started before this hook was created (e.g., it's in
+	// a DLL loaded later).
+	if (hookRecording)
+		WriteFunctionRecord(*this);
+
+	ReleaseSRWLockExclusive(&recordLock);
+}
+
+bool HookStartRecording(const char* path, unsigned long capacity)
+{
+	// A mapping larger than this wouldn't fit in the address space anyway.
+	if (capacity < sizeof(HookLogHeader) || capacity > 0x7FFFFFFF)
+		return false;
+
+	AcquireSRWLockExclusive(&recordLock);
+
+	if (hookRecording)
+	{
+		ReleaseSRWLockExclusive(&recordLock);
+
+		return false;
+	}
+
+	recordFile = CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (recordFile != INVALID_HANDLE_VALUE)
+		recordMapping = CreateFileMapping(recordFile, NULL, PAGE_READWRITE, 0, capacity, NULL);
+
+	if (recordMapping)
+		recordView = (char*)MapViewOfFile(recordMapping, FILE_MAP_WRITE, 0, 0, capacity);
+
+	if (!recordView)
+	{
+		if (recordMapping)
+			CloseHandle(recordMapping);
+
+		if (recordFile != INVALID_HANDLE_VALUE)
+			CloseHandle(recordFile);
+
+		recordFile = INVALID_HANDLE_VALUE;
+		recordMapping = NULL;
+
+		ReleaseSRWLockExclusive(&recordLock);
+
+		return false;
+	}
+
+	recordCapacity = capacity;
+	recordOffset = sizeof(HookLogHeader);
+	recordDropped = 0;
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	HookLogHeader* header = (HookLogHeader*)recordView;
+	std::memcpy(header->magic, HOOK_LOG_MAGIC, sizeof(header->magic));
+	header->version = HOOK_LOG_VERSION;
+	header->slotSize = sizeof(void*);
+	header->frequency = frequency.QuadPart;
+
+	// Describe every function before any calls are recorded.
+	for (HookRecordFunction* function = recordFunctions; function != NULL; function = function->next)
+		WriteFunctionRecord(*function);
+
+	hookRecording = 1;
+
+	ReleaseSRWLockExclusive(&recordLock);
+
+	return true;
+}
+
+unsigned long HookStopRecording()
+{
+	AcquireSRWLockExclusive(&recordLock);
+
+	if (!hookRecording)
+	{
+		ReleaseSRWLockExclusive(&recordLock);
+
+		return 0;
+	}
+
+	hookRecording = 0;
+
+	UnmapViewOfFile(recordView);
+	CloseHandle(recordMapping);
+
+	// The file is as large as the capacity; trim off the unused part.
+	SetFilePointer(recordFile, recordOffset, NULL, FILE_BEGIN);
+	SetEndOfFile(recordFile);
+	CloseHandle(recordFile);
+
+	recordView = NULL;
+	recordMapping = NULL;
+	recordFile = INVALID_HANDLE_VALUE;
+
+	unsigned long dropped = recordDropped;
+
+	ReleaseSRWLockExclusive(&recordLock);
+
+	return dropped;
+}
+
+void HookRecordCall(HookRecordFunction& function, const void* arguments)
+{
+	if (!function.recordable)
+		return;
+
+	LONG size = HookLogRecordSize(function.description.argumentSize);
+
+	AcquireSRWLockShared(&recordLock);
+
+	// Recording may have stopped while waiting for the lock.
+	if (hookRecording)
+	{
+		HookLogRecord* record = ReserveRecord(size);
+
+		if (record)
+		{
+			// The time is taken after reserving the record, so records from
+			// different threads are (nearly) in time order.
+			record->size = size;
+			record->type = HOOK_LOG_RECORD_TYPE_CALL;
+			record->function = function.id;
+			record->time = GetRecordTime();
+
+			std::memcpy(record + 1, arguments, function.description.argumentSize);
+		}
+		else
+		{
+			InterlockedIncrement(&recordDropped);
+		}
+	}
+
+	ReleaseSRWLockShared(&recordLock);
+}
@@ -0,0 +1,505 @@
+/// This file is a part of Capn.
+///
+/// Capn is a useful and multipurpose hooking library for the Windows platform.
+///
+/// Copyright 2015 Aaron Bolyard.
+///
+/// For licensing information, review the LICENSE file located at the root
+/// directory of the source package.
+#ifndef CAPN_RECORD_HPP_
+#define CAPN_RECORD_HPP_
+
+// Hooks can record the arguments of every call into a log, which can later be
+// replayed against a library with the replay utility (see code/replay).
+//
+// This file describes the log format, which is shared between the recorder and
+// the replayer, and so must not depend on Windows.
+
+// Identifies a log file, including the terminating NUL.
+#define HOOK_LOG_MAGIC "CAPNLOG"
+
+// Current version of the log format.
+#define HOOK_LOG_VERSION 1
+
+// Maximum number of arguments a recorded function can have.
+#define HOOK_LOG_MAX_ARGUMENTS 12
+
+// How an argument is passed, as far as replaying is concerned.
+enum HOOK_ARGUMENT_KIND
+{
+	// Integers, enumerations, pointers, and so on.
+	HOOK_ARGUMENT_KIND_INTEGER = 0,
+
+	HOOK_ARGUMENT_KIND_FLOAT,
+	HOOK_ARGUMENT_KIND_DOUBLE,
+
+	// Anything else, such as structures passed by value.
+	// Functions with such arguments are not recorded.
+	HOOK_ARGUMENT_KIND_UNKNOWN
+};
+
+enum HOOK_LOG_RECORD_TYPE
+{
+	// Describes a function. Precedes all calls to the function.
+	HOOK_LOG_RECORD_TYPE_FUNCTION = 1,
+
+	// A call to a function.
+	HOOK_LOG_RECORD_TYPE_CALL = 2
+};
+
+// A log is a HookLogHeader followed by records. Every value is naturally
+// aligned and in the recording machine's byte order, so a log can be mapped
+// into memory and read in place.
+struct HookLogHeader
+{
+	char magic[8];
+	unsigned int version;
+
+	// Size of a stack slot on the recording machine. Each argument takes up a
+	// whole number of stack slots.
+	unsigned int slotSize;
+
+	// Timestamps are in ticks; this is the number of ticks per second.
+	unsigned long long frequency;
+};
+
+// Every record starts with this header. `size' includes the header and is
+// always a multiple of 8; the next record starts `size' bytes later.
+struct HookLogRecord
+{
+	unsigned int size;
+	unsigned short type;
+	unsigned short function;
+	unsigned long long time;
+};
+
+// A function record is followed by this, then by the names of the module
+// (empty for far hooks) and the function, as NUL-terminated strings.
+//
+// A call record is followed by `argumentSize' bytes: the arguments, exactly
+// as they were passed on the stack.
+struct HookLogFunction
+{
+	unsigned int argumentCount;
+	unsigned int argumentSize;
+	unsigned char kinds[HOOK_LOG_MAX_ARGUMENTS];
+	unsigned char sizes[HOOK_LOG_MAX_ARGUMENTS];
+};
+
+// Gets the size of a record with `payloadSize' bytes following the header.
+inline unsigned int HookLogRecordSize(unsigned int payloadSize)
+{
+	return (sizeof(HookLogRecord) + payloadSize + 7) & ~7u;
+}
+
+// Checks if T is a class, structure, or union.
+template <typename T>
+struct HookIsClass
+{
+	template <typename U> static char Test(int U::*);
+	template <typename U> static int Test(...);
+
+	enum { value = sizeof(Test<T>(0)) == sizeof(char) };
+};
+
+template <typename T>
+struct HookArgumentKind
+{
+	enum { value = HookIsClass<T>::value ? HOOK_ARGUMENT_KIND_UNKNOWN : HOOK_ARGUMENT_KIND_INTEGER };
+};
+
+template <>
+struct HookArgumentKind<float>
+{
+	enum { value = HOOK_ARGUMENT_KIND_FLOAT };
+};
+
+template <>
+struct HookArgumentKind<double>
+{
+	enum { value = HOOK_ARGUMENT_KIND_DOUBLE };
+};
+
+template <>
+struct HookArgumentKind<long double>
+{
+	enum { value = HOOK_ARGUMENT_KIND_UNKNOWN };
+};
+
+// References are passed as pointers.
+template <typename T>
+struct HookArgumentKind<T&>
+{
+	enum { value = HOOK_ARGUMENT_KIND_INTEGER };
+};
+
+// Gets the size of an argument of type T, as passed.
+template <typename T>
+struct HookArgumentSize
+{
+	enum { value = sizeof(T) };
+};
+
+template <typename T>
+struct HookArgumentSize<T&>
+{
+	enum { value = sizeof(void*) };
+};
+
+// Adds an argument of type T to the description of a function.
+template <typename T>
+void HookDescribeArgument(HookLogFunction& function, unsigned int index)
+{
+	function.kinds[index] = (unsigned char)HookArgumentKind<T>::value;
+	function.sizes[index] = (unsigned char)HookArgumentSize<T>::value;
+
+	// Arguments are padded to a whole stack slot.
+	function.argumentSize += (HookArgumentSize<T>::value + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+// Describes the arguments of a function signature. `count' is the number of
+// arguments, or -1 if the signature has too many to record.
+//
+// Signatures are given as plain function pointer types, e.g. void (*)(int, float),
+// regardless of the hooked function's calling convention.
+template <typename T>
+struct HookSignature
+{
+	enum { count = -1 };
+
+	static void Describe(HookLogFunction&)
+	{
+		// Nothing.
+	}
+};
+
+template <>
+struct HookSignature<void (*)()>
+{
+	enum { count = 0 };
+
+	static void Describe(HookLogFunction&)
+	{
+		// Nothing.
+	}
+};
+
+template <typename A1>
+struct HookSignature<void (*)(A1)>
+{
+	enum { count = 1 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+	}
+};
+
+template <typename A1, typename A2>
+struct HookSignature<void (*)(A1, A2)>
+{
+	enum { count = 2 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+	}
+};
+
+template <typename A1, typename A2, typename A3>
+struct HookSignature<void (*)(A1, A2, A3)>
+{
+	enum { count = 3 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+	}
+};
+
+template <typename A1, typename A2, typename A3, typename A4>
+struct HookSignature<void (*)(A1, A2, A3, A4)>
+{
+	enum { count = 4 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+		HookDescribeArgument<A4>(function, 3);
+	}
+};
+
+template <typename A1, typename A2, typename A3, typename A4, typename A5>
+struct HookSignature<void (*)(A1, A2, A3, A4, A5)>
+{
+	enum { count = 5 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+		HookDescribeArgument<A4>(function, 3);
+		HookDescribeArgument<A5>(function, 4);
+	}
+};
+
+template <typename A1, typename A2, typename A3, typename A4, typename A5, typename A6>
+struct HookSignature<void (*)(A1, A2, A3, A4, A5, A6)>
+{
+	enum { count = 6 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+		HookDescribeArgument<A4>(function, 3);
+		HookDescribeArgument<A5>(function, 4);
+		HookDescribeArgument<A6>(function, 5);
+	}
+};
+
+template <typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7>
+struct HookSignature<void (*)(A1, A2, A3, A4, A5, A6, A7)>
+{
+	enum { count = 7 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+		HookDescribeArgument<A4>(function, 3);
+		HookDescribeArgument<A5>(function, 4);
+		HookDescribeArgument<A6>(function, 5);
+		HookDescribeArgument<A7>(function, 6);
+	}
+};
+
+template <typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7, typename A8>
+struct HookSignature<void (*)(A1, A2, A3, A4, A5, A6, A7, A8)>
+{
+	enum { count = 8 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+		HookDescribeArgument<A4>(function, 3);
+		HookDescribeArgument<A5>(function, 4);
+		HookDescribeArgument<A6>(function, 5);
+		HookDescribeArgument<A7>(function, 6);
+		HookDescribeArgument<A8>(function, 7);
+	}
+};
+
+template <typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7, typename A8, typename A9>
+struct HookSignature<void (*)(A1, A2, A3, A4, A5, A6, A7, A8, A9)>
+{
+	enum { count = 9 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+		HookDescribeArgument<A4>(function, 3);
+		HookDescribeArgument<A5>(function, 4);
+		HookDescribeArgument<A6>(function, 5);
+		HookDescribeArgument<A7>(function, 6);
+		HookDescribeArgument<A8>(function, 7);
+		HookDescribeArgument<A9>(function, 8);
+	}
+};
+
+template <typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7, typename A8, typename A9, typename A10>
+struct HookSignature<void (*)(A1, A2, A3, A4, A5, A6, A7, A8, A9, A10)>
+{
+	enum { count = 10 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+		HookDescribeArgument<A4>(function, 3);
+		HookDescribeArgument<A5>(function, 4);
+		HookDescribeArgument<A6>(function, 5);
+		HookDescribeArgument<A7>(function, 6);
+		HookDescribeArgument<A8>(function, 7);
+		HookDescribeArgument<A9>(function, 8);
+		HookDescribeArgument<A10>(function, 9);
+	}
+};
+
+template <typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7, typename A8, typename A9, typename A10, typename A11>
+struct HookSignature<void (*)(A1, A2, A3, A4, A5, A6, A7, A8, A9, A10, A11)>
+{
+	enum { count = 11 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+		HookDescribeArgument<A4>(function, 3);
+		HookDescribeArgument<A5>(function, 4);
+		HookDescribeArgument<A6>(function, 5);
+		HookDescribeArgument<A7>(function, 6);
+		HookDescribeArgument<A8>(function, 7);
+		HookDescribeArgument<A9>(function, 8);
+		HookDescribeArgument<A10>(function, 9);
+		HookDescribeArgument<A11>(function, 10);
+	}
+};
+
+template <typename A1, typename A2, typename A3, typename A4, typename A5, typename A6, typename A7, typename A8, typename A9, typename A10, typename A11, typename A12>
+struct HookSignature<void (*)(A1, A2, A3, A4, A5, A6, A7, A8, A9, A10, A11, A12)>
+{
+	enum { count = 12 };
+
+	static void Describe(HookLogFunction& function)
+	{
+		HookDescribeArgument<A1>(function, 0);
+		HookDescribeArgument<A2>(function, 1);
+		HookDescribeArgument<A3>(function, 2);
+		HookDescribeArgument<A4>(function, 3);
+		HookDescribeArgument<A5>(function, 4);
+		HookDescribeArgument<A6>(function, 5);
+		HookDescribeArgument<A7>(function, 6);
+		HookDescribeArgument<A8>(function, 7);
+		HookDescribeArgument<A9>(function, 8);
+		HookDescribeArgument<A10>(function, 9);
+		HookDescribeArgument<A11>(function, 10);
+		HookDescribeArgument<A12>(function, 11);
+	}
+};
+
+// Checks if T and U are the same type.
+template <typename T, typename U>
+struct HookIsSame
+{
+	enum { value = 0 };
+};
+
+template <typename T>
+struct HookIsSame<T, T>
+{
+	enum { value = 1 };
+};
+
+// Checks if calls to a function returning T can be recorded and replayed.
+//
+// Structures may be returned through a hidden pointer, passed before the
+// arguments, which would shift the recorded arguments. Floating point values
+// are returned on the x87 stack, which the replayer would have to clean up.
+template <typename T>
+struct HookIsRecordableReturn
+{
+	enum { value = !HookIsClass<T>::value };
+};
+
+template <>
+struct HookIsRecordableReturn<float>
+{
+	enum { value = 0 };
+};
+
+template <>
+struct HookIsRecordableReturn<double>
+{
+	enum { value = 0 };
+};
+
+template <>
+struct HookIsRecordableReturn<long double>
+{
+	enum { value = 0 };
+};
+
+// Gets the number of arguments to record for a hook, or -1 if calls to it can't
+// be recorded.
+//
+// `Proc' is the hook's function pointer type; `StdcallProc' and `CdeclProc' are
+// the same type, but with those conventions. Only they pass every argument on
+// the stack, where the recorder finds them; __fastcall and __thiscall, for
+// example, pass the first ones in registers.
+template <typename Return, typename Proc, typename StdcallProc, typename CdeclProc, typename Signature>
+struct HookRecordCount
+{
+	enum
+	{
+		value = (HookIsRecordableReturn<Return>::value &&
+			(HookIsSame<Proc, StdcallProc>::value || HookIsSame<Proc, CdeclProc>::value)) ?
+			(int)HookSignature<Signature>::count : -1
+	};
+};
+
+// A function that can be recorded. Created by the HOOK_UTIL_CREATE family of
+// macros; see Hook.hpp.
+struct HookRecordFunction
+{
+	const char* module;
+	const char* name;
+	HookLogFunction description;
+
+	// Identifies the function in the log.
+	unsigned short id;
+
+	// False if the function can't be recorded (e.g., it has too many
+	// arguments, an argument is a structure, or it returns a double).
+	bool recordable;
+
+	// The next function. All functions are kept in a list so that they can be
+	// described when recording starts.
+	HookRecordFunction* next;
+
+	// Constructor. `count' comes from HookRecordCount, and `describe' from
+	// HookSignature.
+	HookRecordFunction(const char* dll, const char* func, int count, void (* describe)(HookLogFunction&));
+};
+
+// Non-zero while recording.
+// Checked by hooks on every call, before doing anything else.
+extern volatile long hookRecording;
+
+// Starts recording calls to `path'.
+//
+// The log is written to a memory-mapped file with room for `capacity' bytes;
+// once it's full, further calls are dropped. Returns false if the log could not
+// be created or recording has already started.
+bool HookStartRecording(const char* path, unsigned long capacity);
+
+// Stops recording and closes the log.
+// Returns the number of calls that were dropped because the log was full.
+unsigned long HookStopRecording();
+
+// Records a call to `function'. `arguments' points to the arguments on the
+// stack (i.e., just past the return address).
+void HookRecordCall(HookRecordFunction& function, const void* arguments);
+
+// Declares the recording information for a hook.
+// Only used by hooks, so unlike the rest of this file, this is Windows-specific.
+#define HOOK_RECORD_DECLARE(funcName, funcModule, returnType, callingConvention, ...) \
+	typedef void (* funcName##Signature)(__VA_ARGS__); \
+	typedef returnType (callingConvention * funcName##RecordProc)(__VA_ARGS__); \
+	typedef returnType (__stdcall * funcName##RecordStdcallProc)(__VA_ARGS__); \
+	typedef returnType (__cdecl * funcName##RecordCdeclProc)(__VA_ARGS__); \
+	HookRecordFunction funcName##Record(funcModule, #funcName, \
+		HookRecordCount<returnType, funcName##RecordProc, funcName##RecordStdcallProc, funcName##RecordCdeclProc, funcName##Signature>::value, \
+		HookSignature<funcName##Signature>::Describe);
+
+// Records a call to a hook, if recording. Must be used in the hook itself,
+// since the arguments are found from the hook's return address.
+#define HOOK_RECORD_CALL(funcName) \
+	if (hookRecording) \
+		HookRecordCall(funcName##Record, (char*)_AddressOfReturnAddress() + sizeof(void*));
+
+#endif
@@ -0,0 +1,716 @@
+/// This file is a part of Capn.
+///
+/// Capn is a useful and multipurpose hooking library for the Windows platform.
+///
+/// Copyright 2015 Aaron Bolyard.
+///
+/// For licensing information, review the LICENSE file located at the root
+/// directory of the source package.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "Record.hpp"
+
+// Replays a log recorded by hooks (see code/hook/Record.hpp) against a library.
+//
+// Every call in the log is made to the function of the same name in the
+// library. Arguments are passed exactly as recorded; in particular, pointers
+// are passed as the addresses they had in the recorded process, so the library
+// should not dereference them. A stand-in library (such as code/standin) that
+// only does the work being measured is the intended target.
+
+// Command line argument type.
+enum ARGUMENT_TYPE
+{
+	ARGUMENT_TYPE_HELP = 0,
+	ARGUMENT_TYPE_LOG,
+	ARGUMENT_TYPE_LIBRARY,
+	ARGUMENT_TYPE_TIMING,
+	ARGUMENT_TYPE_INVALID
+};
+
+struct ArgumentInfo
+{
+	const char* argument;
+	const char* help;
+	ARGUMENT_TYPE type;
+};
+
+// Same format as the injection utility: each option is prefixed by a forward
+// slash, and values directly follow the argument, seperated by a colon.
+const ArgumentInfo Arguments[] =
+{
+	{ "?", NULL, ARGUMENT_TYPE_HELP },
+	{ "log", "Provides the log to replay", ARGUMENT_TYPE_LOG },
+	{ "library", "Provides the library to replay the log against", ARGUMENT_TYPE_LIBRARY },
+	{ "timing", "Waits between calls to match the original timing, instead of running at full speed", ARGUMENT_TYPE_TIMING },
+	{ NULL, NULL, ARGUMENT_TYPE_INVALID } // End of list.
+};
+
+// Checks an argument and sets the option. See the injection utility.
+ARGUMENT_TYPE CheckArgument(const char* a, const char*& option)
+{
+	option = NULL;
+
+	if (std::strlen(a) < 2 || a[0] != '/')
+	{
+		return ARGUMENT_TYPE_INVALID;
+	}
+
+	for (const ArgumentInfo* arg = Arguments; arg->argument != NULL; ++arg)
+	{
+		int argLength = std::strlen(arg->argument);
+
+		if (std::strncmp(arg->argument, a + 1, argLength) == 0)
+		{
+			int l = std::strlen(a + 1);
+
+			if (l == argLength)
+				return arg->type;
+
+			if (l > argLength && a[argLength + 1] == ':')
+			{
+				option = &a[argLength + 2];
+
+				return arg->type;
+			}
+		}
+	}
+
+	return ARGUMENT_TYPE_INVALID;
+}
+
+// Platform specifics: mapping the log, loading the library, and the clock.
+#ifdef _WIN32
+const char* MapLog(const char* path, std::size_t& size)
+{
+	HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	size = GetFileSize(file, NULL);
+
+	HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+
+	if (!mapping)
+		return NULL;
+
+	// The view keeps the mapping alive.
+	const char* view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+
+	return view;
+}
+
+void* LoadTargetLibrary(const char* path)
+{
+	return LoadLibrary(path);
+}
+
+void* GetTargetFunction(void* library, const char* name)
+{
+	return (void*)GetProcAddress((HMODULE)library, name);
+}
+
+double GetTime()
+{
+	static LARGE_INTEGER frequency;
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER time;
+	QueryPerformanceCounter(&time);
+
+	return (double)time.QuadPart / (double)frequency.QuadPart;
+}
+
+void SleepFor(double seconds)
+{
+	Sleep((DWORD)(seconds * 1000.0));
+}
+#else
+const char* MapLog(const char* path, std::size_t& size)
+{
+	int file = open(path, O_RDONLY);
+	if (file < 0)
+		return NULL;
+
+	struct stat status;
+	if (fstat(file, &status) != 0)
+	{
+		close(file);
+
+		return NULL;
+	}
+
+	size = status.st_size;
+
+	void* view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+
+	if (view == MAP_FAILED)
+		return NULL;
+
+	return (const char*)view;
+}
+
+void* LoadTargetLibrary(const char* path)
+{
+	return dlopen(path, RTLD_NOW | RTLD_LOCAL);
+}
+
+void* GetTargetFunction(void* library, const char* name)
+{
+	return dlsym(library, name);
+}
+
+double GetTime()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+void SleepFor(double seconds)
+{
+	timespec time;
+	time.tv_sec = (time_t)seconds;
+	time.tv_nsec = (long)((seconds - time.tv_sec) * 1e9);
+
+	nanosleep(&time, NULL);
+}
+#endif
+
+// Calls a function with recorded arguments.
+//
+// On x86 Windows, the log holds the arguments exactly as they should be on the
+// stack, so they're simply copied there. Restoring the stack pointer afterward
+// makes this work for both caller and callee cleanup. Functions that return
+// floating point values aren't recorded, so nothing is left on the x87 stack.
+//
+// Elsewhere, arguments are passed in registers. Integer and floating point
+// arguments are assigned to separate registers in order, so any mix of them can
+// be passed with a single signature taking every integer register followed by
+// every floating point register. A float is passed in the low half of a double
+// register. This holds for the System V x86-64 and AArch64 conventions.
+#if defined(_WIN32) && defined(_M_IX86)
+// Arguments are copied as is, so they must be laid out in 4-byte slots, as
+// they would be here.
+#define REPLAY_SLOT_SIZE 4
+
+struct ReplayCall
+{
+	void* function;
+	const void* arguments;
+	unsigned int size;
+};
+
+bool PrepareCall(ReplayCall& call, void* function, const HookLogHeader&, const HookLogFunction& description, const char* arguments)
+{
+	// The slot size is checked up front (see REPLAY_SLOT_SIZE).
+	call.function = function;
+	call.arguments = arguments;
+	call.size = description.argumentSize;
+
+	return true;
+}
+
+void MakeCall(const ReplayCall& call)
+{
+	void* function = call.function;
+	const void* arguments = call.arguments;
+	unsigned int size = call.size;
+	unsigned int stack;
+
+	__asm
+	{
+		mov stack, esp
+		mov ecx, size
+		sub esp, ecx
+		mov edi, esp
+		mov esi, arguments
+		shr ecx, 2
+		cld
+		rep movsd
+		call function
+		mov esp, stack
+	}
+}
+#elif defined(__x86_64__) || defined(__aarch64__)
+// Integers beyond the registers go on the stack, in order. Floating point
+// arguments beyond the registers would be interleaved with them, so those
+// aren't supported.
+#define REPLAY_MAX_INTEGERS HOOK_LOG_MAX_ARGUMENTS
+#define REPLAY_MAX_FLOATS 8
+
+typedef void (* ReplayProc)(
+	long, long, long, long, long, long, long, long, long, long, long, long,
+	double, double, double, double, double, double, double, double);
+
+struct ReplayCall
+{
+	ReplayProc function;
+	long integers[REPLAY_MAX_INTEGERS];
+	double floats[REPLAY_MAX_FLOATS];
+};
+
+bool PrepareCall(ReplayCall& call, void* function, const HookLogHeader& header, const HookLogFunction& description, const char* arguments)
+{
+	std::memset(&call, 0, sizeof(ReplayCall));
+	call.function = (ReplayProc)function;
+
+	unsigned int integerCount = 0;
+	unsigned int floatCount = 0;
+
+	for (unsigned int i = 0; i < description.argumentCount; ++i)
+	{
+		unsigned int size = description.sizes[i];
+
+		switch (description.kinds[i])
+		{
+			case HOOK_ARGUMENT_KIND_INTEGER:
+				if (integerCount == REPLAY_MAX_INTEGERS || size > sizeof(long))
+					return false;
+
+				// Integers are zero-extended; the callee only looks at as many
+				// bytes as it expects.
+				std::memcpy(&call.integers[integerCount++], arguments, size);
+				break;
+
+			case HOOK_ARGUMENT_KIND_FLOAT:
+			case HOOK_ARGUMENT_KIND_DOUBLE:
+				if (floatCount == REPLAY_MAX_FLOATS)
+					return false;
+
+				std::memcpy(&call.floats[floatCount++], arguments, size);
+				break;
+
+			default:
+				return false;
+		}
+
+		arguments += (size + header.slotSize - 1) / header.slotSize * header.slotSize;
+	}
+
+	return true;
+}
+
+void MakeCall(const ReplayCall& call)
+{
+	const long* i = call.integers;
+	const double* f = call.floats;
+
+	call.function(
+		i[0], i[1], i[2], i[3], i[4], i[5], i[6], i[7], i[8], i[9], i[10], i[11],
+		f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7]);
+}
+#else
+#error "Replaying is not supported on this platform."
+#endif
+
+// A function in the log, resolved against the target library.
+struct ReplayFunction
+{
+	std::string name;
+	const HookLogFunction* description;
+	void* function;
+
+	// Calls made, calls skipped (because the function couldn't be found or
+	// called), and the number and total time of sampled calls.
+	unsigned long calls;
+	unsigned long skipped;
+	unsigned long samples;
+	double time;
+
+	ReplayFunction()
+		: description(NULL), function(NULL), calls(0), skipped(0), samples(0), time(0.0)
+	{
+		// Nothing.
+	}
+};
+
+// Only every this many calls to each function is timed on its own. Timing a
+// call costs about as much as a cheap call, so timing all of them would slow
+// down the replay and mostly measure the clock.
+//
+// Counting per function, rather than across the log, matters for logs that
+// repeat a fixed pattern of calls (such as a frame loop); otherwise, the same
+// function would be sampled every time.
+#define REPLAY_LATENCY_SAMPLE_INTERVAL 16
+
+// Measures the cost of timing a call (two calls to GetTime), to be subtracted
+// from sampled latencies.
+double GetTimerOverhead()
+{
+	double overhead = 1.0;
+
+	for (int i = 0; i < 1000; ++i)
+	{
+		double before = GetTime();
+		double after = GetTime();
+
+		if (after - before < overhead)
+			overhead = after - before;
+	}
+
+	return overhead;
+}
+
+// Checks that a function record is well-formed: the description and both
+// names fit in the record, and the arguments add up to `argumentSize'.
+bool IsValidFunction(const HookLogHeader& header, const HookLogRecord& record)
+{
+	std::size_t payloadSize = record.size - sizeof(HookLogRecord);
+
+	if (payloadSize < sizeof(HookLogFunction))
+		return false;
+
+	const char* payload = (const char*)(&record + 1);
+	const HookLogFunction* description = (const HookLogFunction*)payload;
+
+	if (description->argumentCount > HOOK_LOG_MAX_ARGUMENTS)
+		return false;
+
+	unsigned int argumentSize = 0;
+	for (unsigned int i = 0; i < description->argumentCount; ++i)
+	{
+		if (description->kinds[i] >= HOOK_ARGUMENT_KIND_UNKNOWN)
+			return false;
+
+		argumentSize += (description->sizes[i] + header.slotSize - 1) / header.slotSize * header.slotSize;
+	}
+
+	if (argumentSize != description->argumentSize)
+		return false;
+
+	// The module and function names must both be terminated within the record.
+	const char* names = payload + sizeof(HookLogFunction);
+	std::size_t namesSize = payloadSize - sizeof(HookLogFunction);
+	const char* moduleEnd = (const char*)std::memchr(names, '\0', namesSize);
+
+	if (!moduleEnd)
+		return false;
+
+	const char* name = moduleEnd + 1;
+	std::size_t nameSize = namesSize - (name - names);
+
+	return std::memchr(name, '\0', nameSize) != NULL;
+}
+
+// Gets the value at `fraction' through the sorted `values'.
+double GetPercentile(const std::vector<double>& values, double fraction)
+{
+	if (values.empty())
+		return 0.0;
+
+	std::size_t index = (std::size_t)(fraction * (values.size() - 1));
+
+	return values[index];
+}
+
+int main(int argc, const char* argv[])
+{
+	const char* logPath = NULL;
+	const char* libraryPath = NULL;
+	bool originalTiming = false;
+	bool showHelp = false;
+
+	for (int i = 1; i < argc && !showHelp; ++i)
+	{
+		const char* option = NULL;
+
+		switch (CheckArgument(argv[i], option))
+		{
+			case ARGUMENT_TYPE_HELP:
+				showHelp = true;
+				break;
+
+			case ARGUMENT_TYPE_LOG:
+				logPath = option;
+				break;
+
+			case ARGUMENT_TYPE_LIBRARY:
+				libraryPath = option;
+				break;
+
+			case ARGUMENT_TYPE_TIMING:
+				originalTiming = true;
+				break;
+
+			default:
+				// Silently ignore invalid input.
+				break;
+		}
+	}
+
+	if (showHelp || argc == 1)
+	{
+		for (const ArgumentInfo* arg = Arguments; arg->argument != NULL; ++arg)
+		{
+			if (arg->help)
+				std::printf("%8s: %s\n", arg->argument, arg->help);
+		}
+
+		return showHelp ? 0 : 1;
+	}
+
+	if (!logPath || !libraryPath)
+	{
+		std::printf("Both a log and a library must be specified.\n");
+		std::printf("Run with /? for  help.\n");
+
+		return 1;
+	}
+
+	std::size_t logSize = 0;
+	const char* log = MapLog(logPath, logSize);
+
+	if (!log)
+	{
+		std::fprintf(stderr, "Could not open log %s!\n", logPath);
+
+		return 1;
+	}
+
+	const HookLogHeader* header = (const HookLogHeader*)log;
+
+	if (logSize < sizeof(HookLogHeader) || std::memcmp(header->magic, HOOK_LOG_MAGIC, sizeof(header->magic)) != 0)
+	{
+		std::fprintf(stderr, "%s is not a log!\n", logPath);
+
+		return 1;
+	}
+
+	if (header->version != HOOK_LOG_VERSION)
+	{
+		std::fprintf(stderr, "Log version %u is not supported (expected %u)!\n", header->version, HOOK_LOG_VERSION);
+
+		return 1;
+	}
+
+	// Every argument is a whole number of slots, and the arguments are copied
+	// a word at a time on x86.
+	if (header->slotSize != 4 && header->slotSize != 8)
+	{
+		std::fprintf(stderr, "Log has an invalid slot size (%u)!\n", header->slotSize);
+
+		return 1;
+	}
+
+#ifdef REPLAY_SLOT_SIZE
+	if (header->slotSize != REPLAY_SLOT_SIZE)
+	{
+		std::fprintf(stderr, "Logs with a slot size of %u can't be replayed here (expected %u)!\n", header->slotSize, REPLAY_SLOT_SIZE);
+
+		return 1;
+	}
+#endif
+
+	// Timestamps are divided by this.
+	if (header->frequency == 0)
+	{
+		std::fprintf(stderr, "Log has an invalid timer frequency!\n");
+
+		return 1;
+	}
+
+	void* library = LoadTargetLibrary(libraryPath);
+
+	if (!library)
+	{
+		std::fprintf(stderr, "Could not load library %s!\n", libraryPath);
+
+		return 1;
+	}
+
+	// Functions are indexed by their ID in the log.
+	std::vector<ReplayFunction> functions;
+
+	// Reserve enough room for every sample up front, so growing the vector
+	// doesn't show up in the replay. No record is smaller than its header, and
+	// each function (of which there are at most 65536) may have one sample more
+	// than its share.
+	std::size_t maxRecords = logSize / sizeof(HookLogRecord);
+	std::vector<double> latencies;
+	latencies.reserve(maxRecords / REPLAY_LATENCY_SAMPLE_INTERVAL + (maxRecords < 0x10000 ? maxRecords : 0x10000));
+
+	double timerOverhead = GetTimerOverhead();
+	unsigned long calls = 0;
+	unsigned long long firstTime = 0;
+	bool first = true;
+	double start = GetTime();
+
+	for (std::size_t offset = sizeof(HookLogHeader); offset + sizeof(HookLogRecord) <= logSize; )
+	{
+		const HookLogRecord* record = (const HookLogRecord*)(log + offset);
+
+		// A truncated or corrupt log. Replay what's there.
+		if (record->size < sizeof(HookLogRecord) || record->size > logSize - offset)
+		{
+			std::fprintf(stderr, "Log is truncated at offset %lu.\n", (unsigned long)offset);
+
+			break;
+		}
+
+		std::size_t recordOffset = offset;
+		offset += record->size;
+
+		const char* payload = (const char*)(record + 1);
+
+		if (record->type == HOOK_LOG_RECORD_TYPE_FUNCTION)
+		{
+			if (!IsValidFunction(*header, *record))
+			{
+				std::fprintf(stderr, "Log has an invalid function at offset %lu.\n", (unsigned long)recordOffset);
+
+				break;
+			}
+
+			if (record->function >= functions.size())
+				functions.resize(record->function + 1);
+
+			ReplayFunction& function = functions[record->function];
+			function.description = (const HookLogFunction*)payload;
+
+			// The module is only informative; the name is looked up in the
+			// target library.
+			const char* module = payload + sizeof(HookLogFunction);
+			function.name = module + std::strlen(module) + 1;
+			function.function = GetTargetFunction(library, function.name.c_str());
+
+			if (!function.function)
+				std::fprintf(stderr, "Could not find %s; calls to it will be skipped.\n", function.name.c_str());
+
+			continue;
+		}
+
+		if (record->type != HOOK_LOG_RECORD_TYPE_CALL || record->function >= functions.size())
+			continue;
+
+		ReplayFunction& function = functions[record->function];
+
+		// A call to a function that was never described.
+		if (!function.description)
+			continue;
+
+		if (function.description->argumentSize > record->size - sizeof(HookLogRecord))
+		{
+			std::fprintf(stderr, "Log has an invalid call at offset %lu.\n", (unsigned long)recordOffset);
+
+			break;
+		}
+
+		ReplayCall call;
+
+		if (!function.function || !PrepareCall(call, function.function, *header, *function.description, payload))
+		{
+			++function.skipped;
+
+			continue;
+		}
+
+		if (originalTiming)
+		{
+			if (first)
+			{
+				firstTime = record->time;
+				start = GetTime();
+				first = false;
+			}
+
+			// Calls from different threads may be slightly out of order; a call
+			// from before the first one is made right away.
+			long long ticks = (long long)(record->time - firstTime);
+			if (ticks < 0)
+				ticks = 0;
+
+			double target = start + (double)ticks / header->frequency;
+
+			// Sleep for most of the wait, then spin for the rest; sleeping
+			// isn't precise.
+			double remaining = target - GetTime();
+			if (remaining > 0.002)
+				SleepFor(remaining - 0.002);
+
+			while (GetTime() < target)
+			{
+				// Nothing.
+			}
+		}
+
+		if (function.calls % REPLAY_LATENCY_SAMPLE_INTERVAL == 0)
+		{
+			double before = GetTime();
+			MakeCall(call);
+			double latency = GetTime() - before - timerOverhead;
+			if (latency < 0.0)
+				latency = 0.0;
+
+			++function.samples;
+			function.time += latency;
+			latencies.push_back(latency);
+		}
+		else
+		{
+			MakeCall(call);
+		}
+
+		++function.calls;
+		++calls;
+	}
+
+	double elapsed = GetTime() - start;
+
+	std::printf("%-32s %12s %12s %12s\n", "function", "calls", "skipped", "avg (ns)");
+
+	for (std::size_t i = 0; i < functions.size(); ++i)
+	{
+		const ReplayFunction& function = functions[i];
+
+		if (function.description == NULL)
+			continue;
+
+		// Functions that were never called have no samples.
+		if (function.samples)
+			std::printf("%-32s %12lu %12lu %12.1f\n", function.name.c_str(), function.calls, function.skipped, function.time / function.samples * 1e9);
+		else
+			std::printf("%-32s %12lu %12lu %12s\n", function.name.c_str(), function.calls, function.skipped, "-");
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	double total = 0.0;
+	for (std::size_t i = 0; i < latencies.size(); ++i)
+		total += latencies[i];
+
+	std::printf("\n");
+	std::printf("calls:      %lu\n", calls);
+	std::printf("elapsed:    %.3f s\n", elapsed);
+	std::printf("throughput: %.0f calls/s\n", elapsed > 0.0 ? calls / elapsed : 0.0);
+	std::printf("latency:    avg %.1f ns, p50 %.1f ns, p99 %.1f ns, max %.1f ns (%lu samples, %.1f ns timer overhead removed)\n",
+		latencies.empty() ? 0.0 : total / latencies.size() * 1e9,
+		GetPercentile(latencies, 0.50) * 1e9,
+		GetPercentile(latencies, 0.99) * 1e9,
+		GetPercentile(latencies, 1.00) * 1e9,
+		(unsigned long)latencies.size(),
+		timerOverhead * 1e9);
+
+	return 0;
+}
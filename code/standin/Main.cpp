@@ -0,0 +1,72 @@
+/// This file is a part of Capn.
+///
+/// Capn is a useful and multipurpose hooking library for the Windows platform.
+///
+/// Copyright 2015 Aaron Bolyard.
+///
+/// For licensing information, review the LICENSE file located at the root
+/// directory of the source package.
+
+// A stand-in for the functions hooked by the example, for replaying logs
+// recorded from it (see code/replay). It builds on any platform, so a log
+// recorded on Windows can be replayed anywhere.
+//
+// Each function does a small, fixed amount of work with its arguments, so the
+// replay measures something. Pointer arguments are never dereferenced; they're
+// addresses from the recorded process.
+#ifdef _WIN32
+#define STANDIN_EXPORT extern "C" __declspec(dllexport)
+#define STANDIN_CALL __stdcall
+#else
+#define STANDIN_EXPORT extern "C" __attribute__((visibility("default")))
+#define STANDIN_CALL
+#endif
+
+// On x86, MSVC exports __stdcall functions with decorated names (e.g.,
+// _glClear@4). Export them under the plain names too, since those are what a
+// log refers to.
+#if defined(_MSC_VER) && defined(_M_IX86)
+#pragma comment(linker, "/export:glBindFramebuffer=_glBindFramebuffer@8")
+#pragma comment(linker, "/export:glBindFramebufferEXT=_glBindFramebufferEXT@8")
+#pragma comment(linker, "/export:glClear=_glClear@4")
+#pragma comment(linker, "/export:glClearColor=_glClearColor@16")
+#pragma comment(linker, "/export:wglGetProcAddress=_wglGetProcAddress@4")
+#endif
+
+typedef unsigned int GLenum;
+typedef unsigned int GLuint;
+typedef unsigned int GLbitfield;
+typedef float GLfloat;
+
+// Stand-in OpenGL state.
+volatile GLuint boundFramebuffer = 0;
+volatile GLbitfield clearedMask = 0;
+volatile GLfloat clearColor[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+STANDIN_EXPORT void STANDIN_CALL glBindFramebuffer(GLenum, GLuint framebuffer)
+{
+	boundFramebuffer = framebuffer;
+}
+
+STANDIN_EXPORT void STANDIN_CALL glBindFramebufferEXT(GLenum target, GLuint framebuffer)
+{
+	glBindFramebuffer(target, framebuffer);
+}
+
+STANDIN_EXPORT void STANDIN_CALL glClear(GLbitfield mask)
+{
+	clearedMask = clearedMask | mask;
+}
+
+STANDIN_EXPORT void STANDIN_CALL glClearColor(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha)
+{
+	clearColor[0] = red;
+	clearColor[1] = green;
+	clearColor[2] = blue;
+	clearColor[3] = alpha;
+}
+
+STANDIN_EXPORT void* STANDIN_CALL wglGetProcAddress(const char*)
+{
+	return 0;
+}
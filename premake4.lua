@@ -11,6 +11,7 @@ project "Hook"
 	kind "StaticLib"
 	language "C++"
 	files { "code/hook/**.cpp", "code/hook/**.hpp" }
+	defines { "_WIN32_WINNT=0x0600" } -- Vista
 	targetname "hook"
 	
 	configuration "Debug"
@@ -49,4 +50,52 @@ project "Example"
 	
 	configuration "Release"
 		flags { "ExtraWarnings", "Optimize" }
-		objdir "build/obj/example/release"
\ No newline at end of file
+		objdir "build/obj/example/release"
+
+project "Bench"
+	kind "ConsoleApp"
+	language "C++"
+	includedirs { "code/hook/" }
+	files { "code/bench/**.cpp", "code/bench/**.hpp" }
+	links { "Hook" }
+	targetname "bench"
+	
+	configuration "Debug"
+		flags { "Symbols", "ExtraWarnings" }
+		objdir "build/obj/bench/debug"
+	
+	configuration "Release"
+		flags { "ExtraWarnings", "Optimize" }
+		objdir "build/obj/bench/release"
+
+project "Replay"
+	kind "ConsoleApp"
+	language "C++"
+	includedirs { "code/hook/" }
+	files { "code/replay/**.cpp", "code/replay/**.hpp" }
+	targetname "replay"
+	
+	configuration "linux"
+		links { "dl" }
+	
+	configuration "Debug"
+		flags { "Symbols", "ExtraWarnings" }
+		objdir "build/obj/replay/debug"
+	
+	configuration "Release"
+		flags { "ExtraWarnings", "Optimize" }
+		objdir "build/obj/replay/release"
+
+project "Standin"
+	kind "SharedLib"
+	language "C++"
+	files { "code/standin/**.cpp", "code/standin/**.hpp" }
+	targetname "standin"
+	
+	configuration "Debug"
+		flags { "Symbols", "ExtraWarnings" }
+		objdir "build/obj/standin/debug"
+	
+	configuration "Release"
+		flags { "ExtraWarnings", "Optimize" }
+		objdir "build/obj/standin/release"